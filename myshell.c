@@ -1,21 +1,129 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define FILTER_HAVE_X86_SIMD 1
+#endif
+
 int locate_pipe_in_arglist(int count, char **arglist);
 
+int execute_simple_command(int count, char **arglist);
+
 int execute_standard_command(char **arglist);
 
 int execute_background_command(int count, char **arglist);
 
 int execute_piped_command(int index, char **arglist);
 
+// A pipeline here is at most "a | b"; wait_for_stages rejects anything longer
+#define MAX_PIPELINE_STAGES 2
+
+int wait_for_stages(int count, const pid_t *pids, char **names, int *statuses);
+
 int execute_output_redirection_command(int argc, char **argv);
 
+// Command lists ("a ; b", "a && b || c", "a & b") and brace groups ("{ a; b; } > file"),
+// evaluated inside the shell. Each function works on the tokens in [start, end) and,
+// when execute is 0, only checks the syntax so a malformed line runs nothing.
+int is_command_list(int count, char **arglist);
+
+int execute_command_list(char **tokens, int start, int end, int execute);
+
+int execute_and_or_list(char **tokens, int start, int end, int execute);
+
+int execute_list_item(char **tokens, int start, int end, int execute);
+
+int execute_group_command(char **tokens, int start, int end, const char *output_file);
+
+int execute_background_list(char **tokens, int start, int end);
+
+void handle_sigchld(int sig);
+
+void record_exit_status(int wait_status);
+
+int exec_failure_status(int error);
+
+int register_background_job(pid_t pid, const char *command);
+
+// Builtin filters (grep -F, wc -l/-c, head, tail) that run as a thread inside the shell
+// when they are the consumer side of a pipe, saving a fork+exec for trivial stages
+typedef enum {
+    FILTER_GREP,
+    FILTER_COUNT_LINES,
+    FILTER_COUNT_BYTES,
+    FILTER_HEAD,
+    FILTER_TAIL
+} FilterKind;
+
+typedef struct {
+    FilterKind kind;
+    const char *pattern;   // FILTER_GREP: fixed string to search for
+    size_t pattern_length;
+    long line_limit;       // FILTER_HEAD / FILTER_TAIL: number of lines to keep
+    int input_fd;          // Owned by the filter, closed once it stops reading
+    int output_fd;
+    int status;            // Exit status the external tool would have returned
+    const char *producer;  // Command writing into input_fd, named in the trace
+} BuiltinFilter;
+
+void init_filter_simd(void);
+
+int parse_builtin_filter(char **argv, BuiltinFilter *filter);
+
+void *run_builtin_filter(void *arg);
+
+int execute_piped_builtin_command(char **argv, BuiltinFilter *filter);
+
+// Execution-timeline tracing, enabled by pointing MYSHELL_TRACE at an output file.
+// Events go to a ring buffer shared with the children, so a forked child can record its
+// own exec before the exec replaces it, and are written as Chrome trace-event JSON
+// (load the file in chrome://tracing or ui.perfetto.dev).
+extern int trace_enabled;
+
+int init_trace(void);
+
+int finalize_trace(void);
+
+uint64_t trace_now(void);
+
+void trace_record(char phase, const char *name, const char *detail, uint64_t start, uint64_t end);
+
+void trace_exec(char **argv);
+
+void trace_exit(pid_t pid, const char *detail);
+
+void trace_first_output(int fd, const char *detail);
+
+int trace_watch_output(int fd, const char *detail, pthread_t *watcher);
+
+void trace_flush(void);
+
+// Each macro is a single predictable branch on trace_enabled when tracing is off
+#define TRACE_START(var) uint64_t var = trace_enabled ? trace_now() : 0
+
+#define TRACE_SPAN(name, detail, start) \
+    do { if (__builtin_expect(trace_enabled, 0)) trace_record('X', name, detail, start, trace_now()); } while (0)
+
+#define TRACE_INSTANT(name, detail) \
+    do { if (__builtin_expect(trace_enabled, 0)) { uint64_t now_ = trace_now(); trace_record('i', name, detail, now_, now_); } } while (0)
+
+#define TRACE_EXIT(pid, detail) \
+    do { if (__builtin_expect(trace_enabled, 0)) trace_exit(pid, detail); } while (0)
+
 // Define an enum for pipe read and write ends for clarity
 typedef enum {
     READ_END = 0,
@@ -35,6 +143,16 @@ typedef enum {
     STDERR = 2
 } StandardFileDescriptors;
 
+// Exit status of the last foreground command, as $? would report it; drives && and ||
+static int last_status = 0;
+
+// Background jobs not reaped yet; handle_sigchld only waits for these, so it never
+// steals the exit status of a foreground command the shell is waiting on
+#define MAX_BACKGROUND_JOBS 256
+#define BACKGROUND_JOB_NAME_SIZE 64
+static volatile pid_t background_jobs[MAX_BACKGROUND_JOBS];
+static char background_job_names[MAX_BACKGROUND_JOBS][BACKGROUND_JOB_NAME_SIZE]; // For the trace
+
 int prepare(void) {
     // After prepare() is executed, the program will not terminate on receiving SIGINT.
     if (signal(SIGINT, SIG_IGN) == SIG_ERR) {
@@ -42,35 +160,90 @@ int prepare(void) {
         return -1;
     }
 
-    // Additionally, handle SIGCHLD signals to prevent zombie processes using ERAN'S TRICK.
-    if (signal(SIGCHLD, SIG_IGN) == SIG_ERR) {
+    // Reap background jobs as they finish to prevent zombie processes. SIGCHLD can no
+    // longer simply be ignored, as that would discard the exit statuses && and || need.
+    struct sigaction child_action;
+    memset(&child_action, 0, sizeof(child_action));
+    child_action.sa_handler = handle_sigchld;
+    sigemptyset(&child_action.sa_mask);
+    child_action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    if (sigaction(SIGCHLD, &child_action, NULL) == -1) {
         perror("Error - failed to modify SIGCHLD signal handling");
         return -1;
     }
 
+    // Pick the widest SIMD scanner the CPU supports for the builtin filters
+    init_filter_simd();
+
+    if (init_trace() != 0) {
+        return -1;
+    }
+
     return 0;
 }
 
 int process_arglist(int count, char **arglist) {
-    // Evaluate each condition to determine the type of shell operation to execute
     int result = 0;
-    int pipe_index;
+    TRACE_START(command_start);
 
-    if (*arglist[count - 1] == '&') {
-        result = execute_background_command(count, arglist);
-    } else if (count > 1 && *arglist[count - 2] == '>') {
-        result = execute_output_redirection_command(count, arglist);
-    } else if ((pipe_index = locate_pipe_in_arglist(count, arglist)) != -1) {
-        result = execute_piped_command(pipe_index, arglist);
+    if (!is_command_list(count, arglist)) {
+        result = execute_simple_command(count, arglist);
     } else {
-        result = execute_standard_command(arglist);
+        // A trailing ';' may be glued to a word ("{ echo hi; }"), so give every ';' its own token
+        char **tokens = malloc(sizeof(char *) * (2 * count + 1));
+        int token_count = 0;
+        if (tokens == NULL) {
+            perror("Error - failed to allocate command list");
+            return EXEC_FAIL;
+        }
+        for (int i = 0; i < count; i++) {
+            size_t length = strlen(arglist[i]);
+            if (length > 1 && arglist[i][length - 1] == ';') {
+                arglist[i][length - 1] = '\0';
+                tokens[token_count++] = arglist[i];
+                tokens[token_count++] = ";";
+            } else {
+                tokens[token_count++] = arglist[i];
+            }
+        }
+        tokens[token_count] = NULL;
+
+        // Check the whole line first, like a real shell, so a syntax error runs nothing
+        result = EXEC_SUCCESS;
+        int valid = execute_command_list(tokens, 0, token_count, 0) == EXEC_SUCCESS;
+        TRACE_SPAN("parse", arglist[0], command_start);
+        if (valid) {
+            result = execute_command_list(tokens, 0, token_count, 1);
+        } else {
+            last_status = 2;
+        }
+        free(tokens);
+    }
+
+    if (trace_enabled) {
+        TRACE_SPAN("command", arglist[0], command_start);
+        trace_flush();
     }
 
     return result;
 }
 
 int finalize(void) {
-    return 0;
+    return finalize_trace();
+}
+
+int execute_simple_command(int count, char **arglist) {
+    // Evaluate each condition to determine the type of shell operation to execute
+    int pipe_index;
+
+    if (*arglist[count - 1] == '&') {
+        return execute_background_command(count, arglist);
+    } else if (count > 1 && *arglist[count - 2] == '>') {
+        return execute_output_redirection_command(count, arglist);
+    } else if ((pipe_index = locate_pipe_in_arglist(count, arglist)) != -1) {
+        return execute_piped_command(pipe_index, arglist);
+    }
+    return execute_standard_command(arglist);
 }
 
 int locate_pipe_in_arglist(int count, char **arglist) {
@@ -85,6 +258,7 @@ int locate_pipe_in_arglist(int count, char **arglist) {
 }
 
 int execute_standard_command(char **arglist) {
+    TRACE_START(fork_start);
     pid_t child_pid = fork();
 
     if (child_pid == -1) {
@@ -94,55 +268,77 @@ int execute_standard_command(char **arglist) {
         // Reset signal handling for the child process to enable SIGINT termination
         if (signal(SIGINT, SIG_DFL) == SIG_ERR) {
             perror("Error - failed to reset SIGINT handling in child process");
-            exit(1);
+            _exit(1);
         }
 
         // Restore default SIGCHLD handling in case execvp doesn't change signals
         if (signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
             perror("Error - failed to reset SIGCHLD handling in child process");
-            exit(1);
+            _exit(1);
         }
 
         // Execute the command and report an error if execution fails
+        trace_exec(arglist);
         if (execvp(arglist[0], arglist) == -1) {
+            int exit_code = exec_failure_status(errno);
             perror("Error - command execution failed in child process");
-            exit(1);
+            _exit(exit_code);
         }
     }
 
     // Parent process
-    if (waitpid(child_pid, NULL, 0) == -1 && errno != ECHILD && errno != EINTR) {
+    int status = 0;
+    TRACE_SPAN("fork", arglist[0], fork_start);
+    if (waitpid(child_pid, &status, 0) == -1 && errno != ECHILD && errno != EINTR) {
         // ECHILD and EINTR in the parent shell after waitpid are not considered as errors
         perror("Error - waitpid failed");
         return EXEC_FAIL ; // error in the original process, so process_arglist should return 0
     }
+    TRACE_EXIT(child_pid, arglist[0]);
+    record_exit_status(status);
     return EXEC_SUCCESS; // no error occurs in the parent so for the shell to handle another command, process_arglist should return 1
 }
 
 int execute_background_command(int count, char **arglist) {
+    sigset_t child_signal, old_mask;
+
+    // Keep handle_sigchld away until the job is registered, in case it exits right away
+    sigemptyset(&child_signal);
+    sigaddset(&child_signal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &child_signal, &old_mask);
+
     // Create a new process for background execution
+    TRACE_START(fork_start);
     pid_t child_pid = fork();
 
     if (child_pid == -1) { // Handle fork failure
         perror("Failed to create a background process");
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
         return EXEC_FAIL; // Indicate error to the parent process
     } else if (child_pid == 0) { // Child process
         // Remove the '&' argument from the argument list as it's not needed
         arglist[count - 1] = NULL;
 
         // Restore default SIGCHLD handling in case execvp doesn't change signals
-        if (signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
+        if (signal(SIGCHLD, SIG_DFL) == SIG_ERR || sigprocmask(SIG_SETMASK, &old_mask, NULL) < 0) {
             perror("Failed to reset signal handling for background process");
-            exit(EXIT_FAILURE);
+            _exit(EXIT_FAILURE);
         }
 
         // Execute the command and report an error if execution fails
+        trace_exec(arglist);
         if (execvp(arglist[0], arglist) == -1) {
+            int exit_code = exec_failure_status(errno);
             perror("Failed to execute the command in the background process");
-            exit(EXIT_FAILURE);
+            _exit(exit_code);
         }
     }
 
+    // The job's exit is traced by handle_sigchld when it reaps it
+    TRACE_SPAN("fork", arglist[0], fork_start);
+    register_background_job(child_pid, arglist[0]);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    last_status = 0;
     return EXEC_SUCCESS; // Indicate success to the parent process
 }
 
@@ -150,13 +346,23 @@ int execute_background_command(int count, char **arglist) {
 
 int execute_piped_command(int argc, char **argv) {
     int pipe_fds[2]; // File descriptors for the pipe
+    BuiltinFilter filter;
     argv[argc] = NULL; // Null-terminate the first part of the argument list
 
+    // Run the second command inside the shell if it is a filter we implement ourselves
+    TRACE_START(plan_start);
+    int is_builtin = parse_builtin_filter(&argv[argc + 1], &filter);
+    TRACE_SPAN("plan", is_builtin ? "builtin filter" : "external filter", plan_start);
+    if (is_builtin) {
+        return execute_piped_builtin_command(argv, &filter);
+    }
+
     if (pipe(pipe_fds) < 0) {
         perror("Failed to create pipe");
         return EXEC_FAIL;
     }
 
+    TRACE_START(fork1_start);
     pid_t pid1 = fork(); // Fork the first child process
     if (pid1 < 0) {
         perror("Forking first child failed");
@@ -165,20 +371,24 @@ int execute_piped_command(int argc, char **argv) {
         // Handle default signals
         if (signal(SIGINT, SIG_DFL) == SIG_ERR || signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
             perror("Failed to set default signal handlers");
-            exit(EXIT_FAILURE);
+            _exit(EXIT_FAILURE);
         }
         close(pipe_fds[READ_END]); // Close read end, not needed
         if (dup2(pipe_fds[WRITE_END], STDOUT_FILENO) < 0) { // Redirect stdout to pipe write end
             perror("Failed to redirect stdout to pipe");
-            exit(EXIT_FAILURE);
+            _exit(EXIT_FAILURE);
         }
         close(pipe_fds[WRITE_END]);
+        trace_exec(argv);
         if (execvp(argv[0], argv) < 0) {
+            int exit_code = exec_failure_status(errno);
             perror("Execution of first command failed");
-            exit(EXIT_FAILURE);
+            _exit(exit_code);
         }
     }
+    TRACE_SPAN("fork", argv[0], fork1_start);
 
+    TRACE_START(fork2_start);
     pid_t pid2 = fork(); // Fork the second child process
     if (pid2 < 0) {
         perror("Forking second child failed");
@@ -187,42 +397,106 @@ int execute_piped_command(int argc, char **argv) {
         // Handle default signals
         if (signal(SIGINT, SIG_DFL) == SIG_ERR || signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
             perror("Failed to set default signal handlers");
-            exit(EXIT_FAILURE);
+            _exit(EXIT_FAILURE);
         }
         close(pipe_fds[WRITE_END]); // Close write end, not needed
         if (dup2(pipe_fds[READ_END], STDIN_FILENO) < 0) { // Redirect stdin from pipe read end
             perror("Failed to redirect stdin from pipe");
-            exit(EXIT_FAILURE);
+            _exit(EXIT_FAILURE);
         }
         close(pipe_fds[READ_END]);
+        trace_exec(&argv[argc + 1]);
         if (execvp(argv[argc + 1], &argv[argc + 1]) < 0) {
+            int exit_code = exec_failure_status(errno);
             perror("Execution of second command failed");
-            exit(EXIT_FAILURE);
+            _exit(exit_code);
         }
     }
+    TRACE_SPAN("fork", argv[argc + 1], fork2_start);
 
-    // Close both ends of the pipe in the parent process
-    close(pipe_fds[READ_END]);
+    // Close both ends of the pipe in the parent process; when tracing, a watcher thread
+    // holds on to the read end until the first command writes and closes it then
+    pthread_t output_watcher;
     close(pipe_fds[WRITE_END]);
+    int watching = trace_watch_output(pipe_fds[READ_END], argv[0], &output_watcher);
 
-    // Wait for both child processes to complete
-    if (waitpid(pid1, NULL, 0) < 0 && errno != ECHILD && errno != EINTR) {
-        perror("Waiting for the first child process failed");
-        return EXEC_FAIL;
+    // Wait for both child processes to complete; the pipe's status is that of the second
+    pid_t pids[MAX_PIPELINE_STAGES] = { pid1, pid2 };
+    char *names[MAX_PIPELINE_STAGES] = { argv[0], argv[argc + 1] };
+    int statuses[MAX_PIPELINE_STAGES] = { 0, 0 };
+    int wait_result = wait_for_stages(MAX_PIPELINE_STAGES, pids, names, statuses);
+    if (watching) {
+        pthread_join(output_watcher, NULL);
     }
-    if (waitpid(pid2, NULL, 0) < 0 && errno != ECHILD && errno != EINTR) {
-        perror("Waiting for the second child process failed");
+    if (wait_result < 0) {
+        perror("Waiting for the piped child processes failed");
         return EXEC_FAIL;
     }
+    record_exit_status(statuses[1]);
 
     return EXEC_SUCCESS; // Execution successful
 }
 
+int wait_for_stages(int count, const pid_t *pids, char **names, int *statuses) {
+    int remaining = count;
+    int reaped[MAX_PIPELINE_STAGES] = { 0 };
+
+    if (count < 1 || count > MAX_PIPELINE_STAGES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Reap the stages in the order they finish rather than in pipeline order, so the
+    // exit recorded for each one (e.g. "sleep 1 | echo hi") is the moment it really ended.
+    // WNOWAIT only peeks at the next finished child; it is reaped below once we know whose it is.
+    while (remaining > 0) {
+        siginfo_t info;
+        int index = -1;
+
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == ECHILD ? 0 : -1; // ECHILD: nothing left to wait for
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (!reaped[i] && pids[i] == info.si_pid) {
+                index = i;
+            }
+        }
+
+        if (index < 0) {
+            // A background job finished first. Reap it now, as handle_sigchld may not have
+            // run yet and waitid would keep reporting it; a child that is no registered job
+            // is reaped directly so it can't stall the loop either
+            sigset_t child_signal, old_mask;
+            sigemptyset(&child_signal);
+            sigaddset(&child_signal, SIGCHLD);
+            sigprocmask(SIG_BLOCK, &child_signal, &old_mask);
+            handle_sigchld(SIGCHLD);
+            waitpid(info.si_pid, NULL, WNOHANG);
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            continue;
+        }
+
+        if (waitpid(pids[index], &statuses[index], 0) < 0 && errno != ECHILD) {
+            return -1;
+        }
+        TRACE_EXIT(pids[index], names[index]);
+        reaped[index] = 1;
+        remaining--;
+    }
+    return 0;
+}
+
 
 
 int execute_output_redirection_command(int argc, char **argv) {
     // Null-terminate the command's argument list and prepare for redirection
     argv[argc - 2] = NULL;
+    TRACE_START(fork_start);
     pid_t child_pid = fork(); // Create a child process
 
     if (child_pid < 0) { // Check if fork failed
@@ -232,33 +506,1286 @@ int execute_output_redirection_command(int argc, char **argv) {
         // Set signal handling to default for SIGINT and SIGCHLD
         if (signal(SIGINT, SIG_DFL) == SIG_ERR || signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
             perror("Error - Setting default signal handlers failed");
-            exit(EXIT_FAILURE);
+            _exit(EXIT_FAILURE);
         }
         // Open the output file with write-only access, create if not exists, truncate if exists
+        TRACE_START(open_start);
         int file_descriptor = open(argv[argc - 1], O_WRONLY | O_CREAT | O_TRUNC, 0777);
         if (file_descriptor < 0) {
             perror("Error - Opening file failed");
-            exit(EXIT_FAILURE);
+            _exit(EXIT_FAILURE);
         }
         // Redirect standard output to the file
         if (dup2(file_descriptor, STDOUT) < 0) {
             perror("Error - Redirecting stdout to file failed");
-            exit(EXIT_FAILURE);
+            _exit(EXIT_FAILURE);
         }
         close(file_descriptor); // Close the file descriptor as it's no longer needed
+        TRACE_SPAN("redirect", argv[argc - 1], open_start);
 
         // Execute the command
+        trace_exec(argv);
         if (execvp(argv[0], argv) < 0) {
+            int exit_code = exec_failure_status(errno);
             perror("Error - Executing command failed");
-            exit(EXIT_FAILURE);
+            _exit(exit_code);
         }
     }
 
     // In parent process, wait for the child to complete
-    if (waitpid(child_pid, NULL, 0) < 0 && errno != ECHILD && errno != EINTR) {
+    int status = 0;
+    TRACE_SPAN("fork", argv[0], fork_start);
+    if (waitpid(child_pid, &status, 0) < 0 && errno != ECHILD && errno != EINTR) {
         perror("Error - Waiting for child process failed");
         return EXEC_FAIL;
     }
+    TRACE_EXIT(child_pid, argv[0]);
+    record_exit_status(status);
 
     return EXEC_SUCCESS; // Indicate successful execution
-}
\ No newline at end of file
+}
+
+
+// ---------------------------------------------------------------------------
+// Command lists and brace groups
+// ---------------------------------------------------------------------------
+
+void handle_sigchld(int sig) {
+    int saved_errno = errno; // waitpid must not clobber errno for the code we interrupted
+    (void)sig;
+
+    for (int i = 0; i < MAX_BACKGROUND_JOBS; i++) {
+        if (background_jobs[i] > 0 && waitpid(background_jobs[i], NULL, WNOHANG) == background_jobs[i]) {
+            TRACE_EXIT(background_jobs[i], background_job_names[i]); // trace_exit is async-signal-safe
+            background_jobs[i] = 0;
+        }
+    }
+    errno = saved_errno;
+}
+
+// Must be called with SIGCHLD blocked so handle_sigchld doesn't run mid-update
+int register_background_job(pid_t pid, const char *command) {
+    for (int i = 0; i < MAX_BACKGROUND_JOBS; i++) {
+        if (background_jobs[i] == 0) {
+            snprintf(background_job_names[i], sizeof(background_job_names[i]), "%s", command);
+            background_jobs[i] = pid;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Error - too many background jobs, process %d will not be reaped\n", pid);
+    return -1;
+}
+
+int exec_failure_status(int error) {
+    // Exit code for a child whose execvp failed, as sh reports it: 127 if the command was
+    // not found, 126 if it was found but could not be run
+    return error == ENOENT ? 127 : 126;
+}
+
+void record_exit_status(int wait_status) {
+    // Same convention as sh: the exit code, or 128 + signal number if it was killed
+    if (WIFEXITED(wait_status)) {
+        last_status = WEXITSTATUS(wait_status);
+    } else if (WIFSIGNALED(wait_status)) {
+        last_status = 128 + WTERMSIG(wait_status);
+    }
+}
+
+static int is_list_separator(const char *token) {
+    return strcmp(token, ";") == 0 || strcmp(token, "&") == 0;
+}
+
+static int is_list_operator(const char *token) {
+    return is_list_separator(token) || strcmp(token, "&&") == 0 || strcmp(token, "||") == 0;
+}
+
+int is_command_list(int count, char **arglist) {
+    // Lines without any list syntax keep going straight to execute_simple_command
+    if (strcmp(arglist[0], "{") == 0) {
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        size_t length = strlen(arglist[i]);
+        if (strcmp(arglist[i], "&&") == 0 || strcmp(arglist[i], "||") == 0 || arglist[i][length - 1] == ';') {
+            return 1;
+        }
+        if (strcmp(arglist[i], "&") == 0 && i != count - 1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int syntax_error(const char *near) {
+    fprintf(stderr, "Error - syntax error near '%s'\n", near != NULL ? near : "end of line");
+    return EXEC_FAIL;
+}
+
+// Index of the first top-level token in [start, end) equal to first or second, or end.
+// '{' and '}' only count as braces in command position, so "echo }" stays an argument.
+static int find_list_operator(char **tokens, int start, int end, const char *first, const char *second) {
+    int depth = 0;
+    int at_command_start = 1;
+
+    for (int i = start; i < end; i++) {
+        if (at_command_start && strcmp(tokens[i], "{") == 0) {
+            depth++;
+        } else if (at_command_start && depth > 0 && strcmp(tokens[i], "}") == 0) {
+            depth--;
+            at_command_start = 0;
+        } else if (is_list_operator(tokens[i])) {
+            if (depth == 0 && (strcmp(tokens[i], first) == 0 || strcmp(tokens[i], second) == 0)) {
+                return i;
+            }
+            at_command_start = 1;
+        } else {
+            at_command_start = 0;
+        }
+    }
+    return end;
+}
+
+// Index of the '}' closing the group that opens at tokens[start], or -1 if it is missing
+static int find_group_end(char **tokens, int start, int end) {
+    int depth = 0;
+    int at_command_start = 1;
+
+    for (int i = start; i < end; i++) {
+        if (at_command_start && strcmp(tokens[i], "{") == 0) {
+            depth++;
+        } else if (at_command_start && strcmp(tokens[i], "}") == 0) {
+            if (--depth == 0) {
+                return i;
+            }
+            at_command_start = 0;
+        } else {
+            at_command_start = is_list_operator(tokens[i]);
+        }
+    }
+    return -1;
+}
+
+int execute_command_list(char **tokens, int start, int end, int execute) {
+    int pos = start;
+
+    while (pos < end) {
+        int separator = find_list_operator(tokens, pos, end, ";", "&");
+        int background = separator < end && strcmp(tokens[separator], "&") == 0;
+
+        if (separator == pos) {
+            return syntax_error(tokens[separator]);
+        }
+
+        int result;
+        if (background && execute) {
+            result = execute_background_list(tokens, pos, separator);
+        } else {
+            result = execute_and_or_list(tokens, pos, separator, execute);
+        }
+        if (result == EXEC_FAIL) {
+            return EXEC_FAIL;
+        }
+        pos = separator + 1;
+    }
+    return EXEC_SUCCESS;
+}
+
+int execute_and_or_list(char **tokens, int start, int end, int execute) {
+    int pos = start;
+    int run = 1;
+
+    while (1) {
+        int operator = find_list_operator(tokens, pos, end, "&&", "||");
+
+        if (operator == pos) {
+            return syntax_error(operator < end ? tokens[operator] : NULL);
+        }
+        // Skipped commands leave last_status alone, so "false && a || b" still runs b
+        if (execute_list_item(tokens, pos, operator, execute && run) == EXEC_FAIL) {
+            return EXEC_FAIL;
+        }
+        if (operator == end) {
+            return EXEC_SUCCESS;
+        }
+        if (operator + 1 == end) {
+            return syntax_error(tokens[operator]);
+        }
+        run = strcmp(tokens[operator], "&&") == 0 ? last_status == 0 : last_status != 0;
+        pos = operator + 1;
+    }
+}
+
+// NULL-terminated copy of tokens[start, end), plus `suffix` if given, for the executors
+// that expect their own argv to write into
+static char **copy_arglist(char **tokens, int start, int end, char *suffix, int *count) {
+    char **arglist = malloc(sizeof(char *) * (end - start + 2));
+
+    if (arglist == NULL) {
+        perror("Error - failed to allocate argument list");
+        return NULL;
+    }
+    *count = 0;
+    for (int i = start; i < end; i++) {
+        arglist[(*count)++] = tokens[i];
+    }
+    if (suffix != NULL) {
+        arglist[(*count)++] = suffix;
+    }
+    arglist[*count] = NULL;
+    return arglist;
+}
+
+int execute_list_item(char **tokens, int start, int end, int execute) {
+    if (strcmp(tokens[start], "{") == 0) {
+        int close = find_group_end(tokens, start, end);
+        const char *output_file = NULL;
+
+        if (close < 0) {
+            return syntax_error("{");
+        }
+        if (close == start + 1) {
+            return syntax_error("}");
+        }
+        // The only thing allowed after the closing brace is an output redirection
+        if (close + 1 < end) {
+            if (close + 3 != end || strcmp(tokens[close + 1], ">") != 0) {
+                return syntax_error(tokens[close + 1]);
+            }
+            output_file = tokens[close + 2];
+        }
+        if (!execute) {
+            return execute_command_list(tokens, start + 1, close, 0);
+        }
+        return execute_group_command(tokens, start + 1, close, output_file);
+    }
+
+    if (strcmp(tokens[start], "}") == 0) {
+        return syntax_error("}");
+    }
+    if (!execute) {
+        return EXEC_SUCCESS;
+    }
+
+    int count;
+    char **arglist = copy_arglist(tokens, start, end, NULL, &count);
+    if (arglist == NULL) {
+        return EXEC_FAIL;
+    }
+    int result = execute_simple_command(count, arglist);
+    free(arglist);
+    return result;
+}
+
+int execute_group_command(char **tokens, int start, int end, const char *output_file) {
+    int saved_stdout = -1;
+
+    // Redirect the shell's own stdout for the duration of the group, so every command in
+    // it (builtin filters included) inherits the file without a subshell
+    if (output_file != NULL) {
+        TRACE_START(open_start);
+        int file_descriptor = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+        if (file_descriptor < 0) {
+            perror("Error - Opening file failed");
+            last_status = 1;
+            return EXEC_SUCCESS; // Like a failed command: the group doesn't run, the shell goes on
+        }
+        fflush(stdout);
+        saved_stdout = fcntl(STDOUT, F_DUPFD_CLOEXEC, STDERR + 1);
+        if (saved_stdout < 0 || dup2(file_descriptor, STDOUT) < 0) {
+            perror("Error - Redirecting stdout to file failed");
+            close(file_descriptor);
+            if (saved_stdout >= 0) {
+                close(saved_stdout);
+            }
+            return EXEC_FAIL;
+        }
+        close(file_descriptor);
+        TRACE_SPAN("redirect", output_file, open_start);
+    }
+
+    int result = execute_command_list(tokens, start, end, 1);
+
+    if (saved_stdout >= 0) {
+        fflush(stdout);
+        if (dup2(saved_stdout, STDOUT) < 0) {
+            perror("Error - Restoring stdout failed");
+            result = EXEC_FAIL;
+        }
+        close(saved_stdout);
+    }
+    return result;
+}
+
+int execute_background_list(char **tokens, int start, int end) {
+    sigset_t child_signal, old_mask;
+    int count;
+
+    // A lone command doesn't need a subshell, execute_background_command already does the job
+    if (strcmp(tokens[start], "{") != 0 && find_list_operator(tokens, start, end, "&&", "||") == end) {
+        char **arglist = copy_arglist(tokens, start, end, "&", &count);
+        if (arglist == NULL) {
+            return EXEC_FAIL;
+        }
+        int result = execute_simple_command(count, arglist);
+        free(arglist);
+        return result;
+    }
+
+    sigemptyset(&child_signal);
+    sigaddset(&child_signal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &child_signal, &old_mask);
+
+    TRACE_START(fork_start);
+    pid_t child_pid = fork();
+
+    if (child_pid == -1) {
+        perror("Failed to create a background process");
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        return EXEC_FAIL;
+    } else if (child_pid == 0) { // Child process, evaluates the whole group or chain as one job
+        // The parent's jobs are not ours to reap
+        memset((void *)background_jobs, 0, sizeof(background_jobs));
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+        // Commands started from here reset SIGINT to its default; a process group of its own
+        // keeps the terminal's Ctrl-C away from the job, as SIG_IGN does for a lone command
+        setpgid(0, 0);
+
+        // Outside the terminal's foreground group, a command reading the terminal would get
+        // SIGTTIN and stop for good, so read /dev/null instead as sh does for async lists
+        int null_descriptor = open("/dev/null", O_RDONLY);
+        if (null_descriptor < 0 || dup2(null_descriptor, STDIN) < 0) {
+            perror("Failed to redirect background job input to /dev/null");
+            _exit(EXIT_FAILURE);
+        }
+        close(null_descriptor);
+
+        int result = execute_and_or_list(tokens, start, end, 1);
+
+        // _exit, not exit: flushing the stdin FILE we inherited would seek the shared stdin
+        // back to where it was at fork time, and the shell would replay the rest of a script
+        _exit(result == EXEC_FAIL ? EXIT_FAILURE : last_status);
+    }
+
+    TRACE_SPAN("fork", tokens[start], fork_start);
+    register_background_job(child_pid, tokens[start]);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    last_status = 0;
+    return EXEC_SUCCESS;
+}
+
+
+
+// ---------------------------------------------------------------------------
+// Builtin pipeline filters
+// ---------------------------------------------------------------------------
+
+#define FILTER_BUFFER_SIZE (64 * 1024)
+#define FILTER_DEFAULT_LINES 10
+
+static const char *filter_names[] = {
+    [FILTER_GREP] = "grep",
+    [FILTER_COUNT_LINES] = "wc -l",
+    [FILTER_COUNT_BYTES] = "wc -c",
+    [FILTER_HEAD] = "head",
+    [FILTER_TAIL] = "tail"
+};
+
+// Scanners used by the filters, selected once in init_filter_simd()
+static size_t (*filter_count_byte)(const char *buf, size_t len, char c);
+static const char *(*filter_find_byte)(const char *buf, size_t len, char c);
+static const char *(*filter_find_substring)(const char *hay, size_t len, const char *needle, size_t needle_len);
+
+static size_t count_byte_scalar(const char *buf, size_t len, char c) {
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++) {
+        count += (buf[i] == c);
+    }
+    return count;
+}
+
+static const char *find_byte_scalar(const char *buf, size_t len, char c) {
+    return memchr(buf, c, len);
+}
+
+static const char *find_substring_scalar(const char *hay, size_t len, const char *needle, size_t needle_len) {
+    return memmem(hay, len, needle, needle_len);
+}
+
+#ifdef FILTER_HAVE_X86_SIMD
+
+// SSE2 is part of the x86-64 baseline, so these need no runtime check
+
+static size_t count_byte_sse2(const char *buf, size_t len, char c) {
+    const __m128i target = _mm_set1_epi8(c);
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(buf + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, target)));
+    }
+    return count + count_byte_scalar(buf + i, len - i, c);
+}
+
+static const char *find_byte_sse2(const char *buf, size_t len, char c) {
+    const __m128i target = _mm_set1_epi8(c);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(buf + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, target));
+        if (mask != 0) {
+            return buf + i + __builtin_ctz(mask);
+        }
+    }
+    return find_byte_scalar(buf + i, len - i, c);
+}
+
+// Compare the first and last needle bytes at every offset of a block at once, and only
+// run memcmp on the offsets where both of them match
+static const char *find_substring_sse2(const char *hay, size_t len, const char *needle, size_t needle_len) {
+    if (needle_len < 2 || needle_len > len) {
+        return needle_len == 1 ? find_byte_sse2(hay, len, needle[0]) : find_substring_scalar(hay, len, needle, needle_len);
+    }
+
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+
+    for (; i + needle_len - 1 + 16 <= len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(hay + i + needle_len - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                            _mm_cmpeq_epi8(block_last, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, needle_len - 2) == 0) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return find_substring_scalar(hay + i, len - i, needle, needle_len);
+}
+
+__attribute__((target("avx2")))
+static size_t count_byte_avx2(const char *buf, size_t len, char c) {
+    const __m256i target = _mm256_set1_epi8(c);
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(buf + i));
+        count += __builtin_popcount((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, target)));
+    }
+    return count + count_byte_sse2(buf + i, len - i, c);
+}
+
+__attribute__((target("avx2")))
+static const char *find_byte_avx2(const char *buf, size_t len, char c) {
+    const __m256i target = _mm256_set1_epi8(c);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, target));
+        if (mask != 0) {
+            return buf + i + __builtin_ctz(mask);
+        }
+    }
+    return find_byte_sse2(buf + i, len - i, c);
+}
+
+__attribute__((target("avx2")))
+static const char *find_substring_avx2(const char *hay, size_t len, const char *needle, size_t needle_len) {
+    if (needle_len < 2 || needle_len > len) {
+        return needle_len == 1 ? find_byte_avx2(hay, len, needle[0]) : find_substring_scalar(hay, len, needle, needle_len);
+    }
+
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+
+    for (; i + needle_len - 1 + 32 <= len; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(hay + i + needle_len - 1));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                                                                                _mm256_cmpeq_epi8(block_last, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, needle_len - 2) == 0) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return find_substring_sse2(hay + i, len - i, needle, needle_len);
+}
+
+#endif
+
+void init_filter_simd(void) {
+    filter_count_byte = count_byte_scalar;
+    filter_find_byte = find_byte_scalar;
+    filter_find_substring = find_substring_scalar;
+
+#ifdef FILTER_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        filter_count_byte = count_byte_avx2;
+        filter_find_byte = find_byte_avx2;
+        filter_find_substring = find_substring_avx2;
+    } else {
+        filter_count_byte = count_byte_sse2;
+        filter_find_byte = find_byte_sse2;
+        filter_find_substring = find_substring_sse2;
+    }
+#endif
+}
+
+// Parse a non-negative line count such as the "5" in "head -n 5"; returns 1 on success
+static int parse_line_count(const char *text, long *count) {
+    char *end;
+
+    if (*text < '0' || *text > '9') {
+        return 0;
+    }
+    errno = 0;
+    *count = strtol(text, &end, 10);
+    return errno == 0 && *end == '\0';
+}
+
+// Accepts "", "-N", "-nN" and "-n N" the way head and tail do
+static int parse_line_limit(char **args, long *limit) {
+    *limit = FILTER_DEFAULT_LINES;
+
+    if (args[0] == NULL) {
+        return 1;
+    }
+    if (strcmp(args[0], "-n") == 0) {
+        return args[1] != NULL && args[2] == NULL && parse_line_count(args[1], limit);
+    }
+    if (args[1] != NULL || args[0][0] != '-') {
+        return 0;
+    }
+    return parse_line_count(args[0][1] == 'n' ? args[0] + 2 : args[0] + 1, limit);
+}
+
+int parse_builtin_filter(char **argv, BuiltinFilter *filter) {
+    // Only the exact flag combinations below are handled in-process; anything else
+    // (extra flags, file arguments, regular expressions) goes to the real program
+    memset(filter, 0, sizeof(*filter));
+
+    if (argv[0] == NULL) {
+        return 0;
+    }
+
+    if (strcmp(argv[0], "grep") == 0) {
+        char **args = &argv[1];
+        int fixed = 0;
+
+        if (args[0] != NULL && strcmp(args[0], "-F") == 0) {
+            fixed = 1;
+            args++;
+        }
+        if (args[0] == NULL || args[1] != NULL || args[0][0] == '-') {
+            return 0;
+        }
+        // Without -F the pattern is a basic regular expression, which only matches
+        // as a plain string if it contains none of the BRE special characters
+        if (!fixed && strpbrk(args[0], "\\.[]*^$") != NULL) {
+            return 0;
+        }
+        filter->kind = FILTER_GREP;
+        filter->pattern = args[0];
+        filter->pattern_length = strlen(args[0]);
+        return 1;
+    }
+
+    if (strcmp(argv[0], "wc") == 0) {
+        if (argv[1] == NULL || argv[2] != NULL) {
+            return 0;
+        }
+        if (strcmp(argv[1], "-l") == 0) {
+            filter->kind = FILTER_COUNT_LINES;
+            return 1;
+        }
+        if (strcmp(argv[1], "-c") == 0) {
+            filter->kind = FILTER_COUNT_BYTES;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (strcmp(argv[0], "head") == 0) {
+        filter->kind = FILTER_HEAD;
+        return parse_line_limit(&argv[1], &filter->line_limit);
+    }
+
+    if (strcmp(argv[0], "tail") == 0) {
+        filter->kind = FILTER_TAIL;
+        return parse_line_limit(&argv[1], &filter->line_limit);
+    }
+
+    return 0;
+}
+
+// Buffered writer so matches are emitted in large write() calls rather than one per line
+typedef struct {
+    int fd;
+    int failed; // Set once the reader went away (EPIPE) or the write otherwise failed
+    size_t used;
+    char data[FILTER_BUFFER_SIZE];
+} FilterOutput;
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static void filter_output_flush(FilterOutput *out) {
+    if (!out->failed && out->used > 0 && write_all(out->fd, out->data, out->used) < 0) {
+        out->failed = 1;
+    }
+    out->used = 0;
+}
+
+static void filter_output_append(FilterOutput *out, const char *data, size_t len) {
+    if (out->used + len > sizeof(out->data)) {
+        filter_output_flush(out);
+    }
+    if (len > sizeof(out->data)) {
+        if (!out->failed && write_all(out->fd, data, len) < 0) {
+            out->failed = 1;
+        }
+        return;
+    }
+    memcpy(out->data + out->used, data, len);
+    out->used += len;
+}
+
+static ssize_t read_retry(int fd, char *buf, size_t len) {
+    ssize_t got;
+    do {
+        got = read(fd, buf, len);
+    } while (got < 0 && errno == EINTR);
+    return got;
+}
+
+// Emit every line of [buf, buf + len) that contains the pattern; returns 1 if any did
+static int grep_block(BuiltinFilter *filter, FilterOutput *out, const char *buf, size_t len) {
+    const char *pos = buf;
+    const char *end = buf + len;
+    int matched = 0;
+
+    // Search the whole block for the pattern instead of going line by line, and only
+    // locate the surrounding line once there is a hit
+    while (pos < end && !out->failed) {
+        const char *hit = filter_find_substring(pos, end - pos, filter->pattern, filter->pattern_length);
+        if (hit == NULL) {
+            break;
+        }
+
+        const char *line_start = memrchr(pos, '\n', hit - pos);
+        line_start = line_start == NULL ? pos : line_start + 1;
+        const char *newline = filter_find_byte(hit, end - hit, '\n');
+        const char *line_end = newline == NULL ? end : newline + 1;
+
+        filter_output_append(out, line_start, line_end - line_start);
+        if (newline == NULL) {
+            filter_output_append(out, "\n", 1); // grep terminates the last line even if the input doesn't
+        }
+        matched = 1;
+        pos = line_end;
+    }
+    return matched;
+}
+
+static void run_grep(BuiltinFilter *filter, FilterOutput *out) {
+    size_t capacity = FILTER_BUFFER_SIZE;
+    size_t used = 0;
+    char *buf = malloc(capacity);
+    int matched = 0;
+
+    filter->status = 2;
+    if (buf == NULL) {
+        perror("Error - grep builtin failed to allocate buffer");
+        return;
+    }
+
+    while (!out->failed) {
+        if (used == capacity) { // A single line longer than the buffer
+            char *grown = realloc(buf, capacity * 2);
+            if (grown == NULL) {
+                perror("Error - grep builtin failed to grow buffer");
+                free(buf);
+                return;
+            }
+            buf = grown;
+            capacity *= 2;
+        }
+
+        ssize_t got = read_retry(filter->input_fd, buf + used, capacity - used);
+        if (got < 0) {
+            perror("Error - grep builtin failed to read from pipe");
+            free(buf);
+            return;
+        }
+        if (got == 0) {
+            matched |= grep_block(filter, out, buf, used); // Final line without a newline
+            break;
+        }
+        used += got;
+
+        // Only scan complete lines, keep the partial tail for the next read
+        const char *last_newline = memrchr(buf, '\n', used);
+        if (last_newline != NULL) {
+            size_t complete = last_newline - buf + 1;
+            matched |= grep_block(filter, out, buf, complete);
+            memmove(buf, buf + complete, used - complete);
+            used -= complete;
+
+            // Emit matches as soon as the read that produced them is done, so a slow
+            // producer ("tail -f log | grep ERR") shows lines as they arrive; a busy pipe
+            // still fills whole reads and keeps the writes large
+            filter_output_flush(out);
+        }
+    }
+
+    free(buf);
+    filter->status = matched ? 0 : 1;
+}
+
+static void run_count(BuiltinFilter *filter, FilterOutput *out) {
+    char buf[FILTER_BUFFER_SIZE];
+    size_t total = 0;
+    ssize_t got;
+    char line[32];
+
+    while ((got = read_retry(filter->input_fd, buf, sizeof(buf))) > 0) {
+        total += filter->kind == FILTER_COUNT_LINES ? filter_count_byte(buf, got, '\n') : (size_t)got;
+    }
+    if (got < 0) {
+        perror("Error - wc builtin failed to read from pipe");
+        filter->status = 1;
+        return;
+    }
+
+    int len = snprintf(line, sizeof(line), "%zu\n", total);
+    filter_output_append(out, line, len);
+    filter->status = 0;
+}
+
+static void run_head(BuiltinFilter *filter, FilterOutput *out) {
+    char buf[FILTER_BUFFER_SIZE];
+    long remaining = filter->line_limit;
+    ssize_t got = 0;
+
+    while (remaining > 0 && !out->failed && (got = read_retry(filter->input_fd, buf, sizeof(buf))) > 0) {
+        const char *pos = buf;
+        const char *end = buf + got;
+
+        while (remaining > 0 && pos < end) {
+            const char *newline = filter_find_byte(pos, end - pos, '\n');
+            if (newline == NULL) {
+                pos = end;
+                break;
+            }
+            pos = newline + 1;
+            remaining--;
+        }
+        filter_output_append(out, buf, pos - buf);
+        filter_output_flush(out); // Same as grep: don't hold lines back from a slow producer
+    }
+    if (got < 0) {
+        perror("Error - head builtin failed to read from pipe");
+        filter->status = 1;
+        return;
+    }
+    filter->status = 0;
+}
+
+// Offset in buf where the last `lines` lines begin; an unterminated final line counts as one
+static size_t tail_start(const char *buf, size_t len, long lines) {
+    size_t end = len;
+
+    if (lines == 0) {
+        return len;
+    }
+    if (end > 0 && buf[end - 1] == '\n') {
+        end--;
+    }
+    for (long i = 0; i < lines; i++) {
+        const char *newline = memrchr(buf, '\n', end);
+        if (newline == NULL) {
+            return 0;
+        }
+        end = newline - buf;
+    }
+    return end + 1;
+}
+
+static void run_tail(BuiltinFilter *filter, FilterOutput *out) {
+    size_t capacity = FILTER_BUFFER_SIZE;
+    size_t used = 0;
+    char *buf = malloc(capacity);
+    ssize_t got;
+
+    filter->status = 1;
+    if (buf == NULL) {
+        perror("Error - tail builtin failed to allocate buffer");
+        return;
+    }
+
+    while (1) {
+        if (used == capacity) {
+            // Drop everything before the last lines first, grow only if that frees nothing
+            size_t start = tail_start(buf, used, filter->line_limit);
+            if (start > 0) {
+                memmove(buf, buf + start, used - start);
+                used -= start;
+            } else {
+                char *grown = realloc(buf, capacity * 2);
+                if (grown == NULL) {
+                    perror("Error - tail builtin failed to grow buffer");
+                    free(buf);
+                    return;
+                }
+                buf = grown;
+                capacity *= 2;
+            }
+        }
+
+        got = read_retry(filter->input_fd, buf + used, capacity - used);
+        if (got <= 0) {
+            break;
+        }
+        used += got;
+    }
+
+    if (got < 0) {
+        perror("Error - tail builtin failed to read from pipe");
+    } else {
+        size_t start = tail_start(buf, used, filter->line_limit);
+        filter_output_append(out, buf + start, used - start);
+        filter->status = 0;
+    }
+    free(buf);
+}
+
+void *run_builtin_filter(void *arg) {
+    BuiltinFilter *filter = arg;
+    FilterOutput *out = malloc(sizeof(FilterOutput));
+    sigset_t pipe_signal;
+
+    // A closed downstream reader must fail our write() with EPIPE instead of killing the
+    // shell; the mask is per-thread and so is not inherited by commands forked elsewhere
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, NULL);
+
+    if (out == NULL) {
+        perror("Error - builtin filter failed to allocate output buffer");
+        filter->status = 2;
+        close(filter->input_fd);
+        return NULL;
+    }
+    out->fd = filter->output_fd;
+    out->failed = 0;
+    out->used = 0;
+
+    TRACE_START(filter_start);
+    trace_first_output(filter->input_fd, filter->producer);
+
+    switch (filter->kind) {
+        case FILTER_GREP:
+            run_grep(filter, out);
+            break;
+        case FILTER_COUNT_LINES:
+        case FILTER_COUNT_BYTES:
+            run_count(filter, out);
+            break;
+        case FILTER_HEAD:
+            run_head(filter, out);
+            break;
+        case FILTER_TAIL:
+            run_tail(filter, out);
+            break;
+    }
+
+    // Closing the read end as soon as we are done lets an upstream writer get SIGPIPE
+    // (e.g. "yes | head") rather than block forever on a full pipe
+    close(filter->input_fd);
+    filter_output_flush(out);
+    free(out);
+    TRACE_SPAN("builtin filter", filter_names[filter->kind], filter_start);
+    return NULL;
+}
+
+int execute_piped_builtin_command(char **argv, BuiltinFilter *filter) {
+    int pipe_fds[2];
+    pthread_t filter_thread;
+
+    if (pipe(pipe_fds) < 0) {
+        perror("Failed to create pipe");
+        return EXEC_FAIL;
+    }
+
+    TRACE_START(fork_start);
+    pid_t pid1 = fork(); // Fork the first command, the filter stays in the shell
+    if (pid1 < 0) {
+        perror("Forking first child failed");
+        close(pipe_fds[READ_END]);
+        close(pipe_fds[WRITE_END]);
+        return EXEC_FAIL;
+    } else if (pid1 == 0) { // First child process
+        if (signal(SIGINT, SIG_DFL) == SIG_ERR || signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
+            perror("Failed to set default signal handlers");
+            _exit(EXIT_FAILURE);
+        }
+        close(pipe_fds[READ_END]);
+        if (dup2(pipe_fds[WRITE_END], STDOUT_FILENO) < 0) {
+            perror("Failed to redirect stdout to pipe");
+            _exit(EXIT_FAILURE);
+        }
+        close(pipe_fds[WRITE_END]);
+        trace_exec(argv);
+        if (execvp(argv[0], argv) < 0) {
+            int exit_code = exec_failure_status(errno);
+            perror("Execution of first command failed");
+            _exit(exit_code);
+        }
+    }
+    TRACE_SPAN("fork", argv[0], fork_start);
+
+    // The filter only sees EOF once the shell's copy of the write end is gone
+    close(pipe_fds[WRITE_END]);
+
+    filter->input_fd = pipe_fds[READ_END];
+    filter->output_fd = STDOUT_FILENO;
+    filter->producer = argv[0];
+    int status = 0;
+    int error = pthread_create(&filter_thread, NULL, run_builtin_filter, filter);
+    if (error != 0) {
+        errno = error;
+        perror("Failed to start builtin filter thread");
+        close(pipe_fds[READ_END]);
+        waitpid(pid1, &status, 0);
+        return EXEC_FAIL;
+    }
+
+    // Reap the first command the same way execute_piped_command reaps its stages; as
+    // there, the pipe's status is that of the second stage, here the filter's
+    if (wait_for_stages(1, &pid1, argv, &status) < 0) {
+        perror("Waiting for the first child process failed");
+        pthread_join(filter_thread, NULL);
+        return EXEC_FAIL;
+    }
+    pthread_join(filter_thread, NULL);
+    last_status = filter->status;
+
+    return EXEC_SUCCESS;
+}
+
+
+
+
+// ---------------------------------------------------------------------------
+// Execution-timeline tracing
+// ---------------------------------------------------------------------------
+
+#define TRACE_RING_SIZE 16384 // Events kept before the oldest unflushed ones are overwritten
+#define TRACE_NAME_SIZE 24
+#define TRACE_DETAIL_SIZE 64
+
+typedef struct {
+    _Atomic uint64_t sequence; // Slot index + 1 once every other field has been written
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    int32_t pid;
+    int32_t tid;
+    char phase;                // 'X' for a span, 'i' for an instant
+    char name[TRACE_NAME_SIZE];
+    char detail[TRACE_DETAIL_SIZE];
+} TraceEvent;
+
+// Lives in a MAP_SHARED mapping, so children keep writing to the same ring after fork()
+typedef struct {
+    _Atomic uint64_t head; // Next slot to reserve
+    TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+int trace_enabled = 0;
+static TraceRing *trace_ring;
+static FILE *trace_file;
+static uint64_t trace_flushed;  // Next slot the shell will write to trace_file
+static int trace_wrote_event;   // Whether a separating comma is needed before the next event
+
+uint64_t trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+int init_trace(void) {
+    const char *path = getenv("MYSHELL_TRACE");
+
+    if (path == NULL || *path == '\0') {
+        return 0;
+    }
+
+    trace_ring = mmap(NULL, sizeof(TraceRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (trace_ring == MAP_FAILED) {
+        perror("Error - failed to map trace buffer");
+        trace_ring = NULL;
+        return -1;
+    }
+
+    trace_file = fopen(path, "w");
+    if (trace_file == NULL) {
+        perror("Error - failed to open trace file");
+        munmap(trace_ring, sizeof(TraceRing));
+        trace_ring = NULL;
+        return -1;
+    }
+    // The trace file descriptor must not leak into the commands we run
+    fcntl(fileno(trace_file), F_SETFD, FD_CLOEXEC);
+
+    // JSON Array Format: viewers accept the file even if the shell dies before the closing ']'
+    fputs("[\n", trace_file);
+    fflush(trace_file);
+    trace_enabled = 1;
+    return 0;
+}
+
+// snprintf is not async-signal-safe, and handle_sigchld records job exits from the handler
+static void trace_copy_string(char *dest, size_t size, const char *src) {
+    size_t i = 0;
+
+    for (; src != NULL && src[i] != '\0' && i + 1 < size; i++) {
+        dest[i] = src[i];
+    }
+    dest[i] = '\0';
+}
+
+static void trace_store(char phase, const char *name, const char *detail, uint64_t start, uint64_t end, pid_t pid, pid_t tid) {
+    // Reserving a slot is the only shared write, so the shell, its filter threads and
+    // its children can all record at once without a lock
+    uint64_t index = atomic_fetch_add_explicit(&trace_ring->head, 1, memory_order_relaxed);
+    TraceEvent *event = &trace_ring->events[index % TRACE_RING_SIZE];
+
+    // Seqlock-style publish: a reader that sees the same sequence before and after copying
+    // the slot knows none of these writes landed in between
+    atomic_store_explicit(&event->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    event->start_ns = start;
+    event->duration_ns = end - start;
+    event->pid = pid;
+    event->tid = tid;
+    event->phase = phase;
+    trace_copy_string(event->name, sizeof(event->name), name);
+    trace_copy_string(event->detail, sizeof(event->detail), detail);
+    atomic_store_explicit(&event->sequence, index + 1, memory_order_release);
+}
+
+void trace_record(char phase, const char *name, const char *detail, uint64_t start, uint64_t end) {
+    trace_store(phase, name, detail, start, end, getpid(), gettid());
+}
+
+void trace_exit(pid_t pid, const char *detail) {
+    // Recorded by the shell once the child is reaped, but drawn on the child's own track
+    uint64_t now = trace_now();
+    trace_store('i', "exit", detail, now, now, pid, pid);
+}
+
+void trace_exec(char **argv) {
+    if (!trace_enabled) {
+        return;
+    }
+
+    // execvp searches PATH itself without reporting how long that took, so repeat the
+    // same lookup here to time it; commands containing a '/' are not searched
+    if (strchr(argv[0], '/') == NULL) {
+        TRACE_START(search_start);
+        const char *path = getenv("PATH");
+        char candidate[4096];
+
+        while (path != NULL && *path != '\0') {
+            const char *separator = strchr(path, ':');
+            int dir_length = separator != NULL ? (int)(separator - path) : (int)strlen(path);
+
+            snprintf(candidate, sizeof(candidate), "%.*s/%s", dir_length, dir_length > 0 ? path : ".", argv[0]);
+            if (access(candidate, X_OK) == 0) {
+                break;
+            }
+            path = separator != NULL ? separator + 1 : NULL;
+        }
+        TRACE_SPAN("path search", argv[0], search_start);
+    }
+    TRACE_INSTANT("exec", argv[0]);
+}
+
+void trace_first_output(int fd, const char *detail) {
+    struct pollfd readable = { .fd = fd, .events = POLLIN };
+
+    if (!trace_enabled) {
+        return;
+    }
+
+    // Wait until the stage has written something we have not consumed; poll() leaves the
+    // data in the pipe. Output drained by the reader before we look goes unnoticed, and a
+    // stage that exits silently only reports POLLHUP, in which case nothing is recorded.
+    while (poll(&readable, 1, -1) < 0 && errno == EINTR) {
+    }
+    if (readable.revents & POLLIN) {
+        TRACE_INSTANT("first output", detail);
+    }
+}
+
+typedef struct {
+    int fd;
+    const char *detail;
+} OutputWatch;
+
+static void *run_output_watch(void *arg) {
+    OutputWatch *watch = arg;
+
+    trace_first_output(watch->fd, watch->detail);
+    close(watch->fd);
+    free(watch);
+    return NULL;
+}
+
+int trace_watch_output(int fd, const char *detail, pthread_t *watcher) {
+    // Blocking on the pipe in the shell itself would hold up reaping the stages, and with
+    // it their exit timestamps, until the first command writes or exits. Returns 1 if a
+    // watcher thread took over fd and must be joined, 0 if fd has been closed here.
+    if (trace_enabled) {
+        OutputWatch *watch = malloc(sizeof(OutputWatch));
+        if (watch != NULL) {
+            watch->fd = fd;
+            watch->detail = detail;
+            if (pthread_create(watcher, NULL, run_output_watch, watch) == 0) {
+                return 1;
+            }
+            free(watch);
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static void trace_write_string(const char *text) {
+    for (; *text != '\0'; text++) {
+        unsigned char c = (unsigned char)*text;
+        if (c == '"' || c == '\\') {
+            fputc('\\', trace_file);
+            fputc(c, trace_file);
+        } else if (c < 0x20) {
+            fprintf(trace_file, "\\u%04x", c);
+        } else {
+            fputc(c, trace_file);
+        }
+    }
+}
+
+static void trace_write_event(const TraceEvent *event) {
+    fputs(trace_wrote_event ? ",\n" : "", trace_file);
+    trace_wrote_event = 1;
+
+    // Trace-event timestamps are in microseconds; keep the nanoseconds as decimals
+    fputs("{\"name\":\"", trace_file);
+    trace_write_string(event->name);
+    fprintf(trace_file, "\",\"cat\":\"shell\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d",
+            event->phase,
+            (unsigned long long)(event->start_ns / 1000), (unsigned long long)(event->start_ns % 1000),
+            event->pid, event->tid);
+    if (event->phase == 'X') {
+        fprintf(trace_file, ",\"dur\":%llu.%03llu",
+                (unsigned long long)(event->duration_ns / 1000), (unsigned long long)(event->duration_ns % 1000));
+    } else {
+        fputs(",\"s\":\"t\"", trace_file);
+    }
+    fputs(",\"args\":{\"detail\":\"", trace_file);
+    trace_write_string(event->detail);
+    fputs("\"}}", trace_file);
+}
+
+static void trace_drain(int final) {
+    uint64_t head = atomic_load_explicit(&trace_ring->head, memory_order_acquire);
+
+    // Anything older than one ring length has been overwritten already
+    if (head - trace_flushed > TRACE_RING_SIZE) {
+        trace_flushed = head - TRACE_RING_SIZE;
+    }
+
+    for (; trace_flushed < head; trace_flushed++) {
+        TraceEvent *event = &trace_ring->events[trace_flushed % TRACE_RING_SIZE];
+        uint64_t sequence = atomic_load_explicit(&event->sequence, memory_order_acquire);
+        TraceEvent snapshot;
+
+        if (sequence > trace_flushed + 1) {
+            continue; // A writer has lapped the ring and reused this slot; the event is lost
+        }
+        if (sequence != trace_flushed + 1) {
+            // Reserved but not yet published, e.g. by a background child that is still
+            // writing it; pick it up on the next flush unless this is the last one
+            if (!final) {
+                break;
+            }
+            continue;
+        }
+
+        // Copy the slot out, then check nobody started rewriting it meanwhile, so a writer
+        // lapping the ring during the drain can't leave a torn event in the JSON
+        snapshot.start_ns = event->start_ns;
+        snapshot.duration_ns = event->duration_ns;
+        snapshot.pid = event->pid;
+        snapshot.tid = event->tid;
+        snapshot.phase = event->phase;
+        memcpy(snapshot.name, event->name, sizeof(snapshot.name));
+        memcpy(snapshot.detail, event->detail, sizeof(snapshot.detail));
+        snapshot.name[sizeof(snapshot.name) - 1] = '\0';
+        snapshot.detail[sizeof(snapshot.detail) - 1] = '\0';
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&event->sequence, memory_order_relaxed) != sequence) {
+            continue;
+        }
+        trace_write_event(&snapshot);
+    }
+}
+
+void trace_flush(void) {
+    if (!trace_enabled) {
+        return;
+    }
+    trace_drain(0);
+    // Leave nothing buffered, so a child forked next inherits an empty FILE buffer
+    fflush(trace_file);
+}
+
+int finalize_trace(void) {
+    if (!trace_enabled) {
+        return 0;
+    }
+    trace_enabled = 0;
+    trace_drain(1);
+    fputs("\n]\n", trace_file);
+    if (fclose(trace_file) != 0) {
+        perror("Error - failed to write trace file");
+        return -1;
+    }
+    munmap(trace_ring, sizeof(TraceRing));
+    return 0;
+}